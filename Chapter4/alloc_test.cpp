@@ -0,0 +1,138 @@
+// 解析器的堆分配测试：直接包含toy.cpp，用全局的operator new统计词法分析
+// 与解析时的分配次数，检查它们与toy.cpp中解析器开头的注释一致。
+// 编译与运行（llvm-config的--cxxflags可能指定了更旧的-std，因此放在它之后）：
+//   clang++ -g alloc_test.cpp `llvm-config --cxxflags --ldflags --system-libs
+//     --libs core orcjit native` -std=c++17 -o alloc_test && ./alloc_test
+#define main toy_main
+#include "toy.cpp"
+#undef main
+
+#include <cstdlib>
+#include <cstring>
+
+static bool Counting = false;
+static unsigned long NumAllocs = 0;
+
+void *operator new(std::size_t Size) {
+  if (Counting) {
+    ++NumAllocs;
+  }
+  if (void *P = std::malloc(Size ? Size : 1)) {
+    return P;
+  }
+  // LLVM通常以-fno-exceptions编译，无法抛出std::bad_alloc
+  std::abort();
+}
+
+void operator delete(void *P) noexcept { std::free(P); }
+void operator delete(void *P, std::size_t) noexcept { std::free(P); }
+
+static int Failures = 0;
+
+static void check(const char *What, unsigned long Got, unsigned long Expected) {
+  if (Got == Expected) {
+    printf("PASS: %s (%lu allocations)\n", What, Got);
+  } else {
+    printf("FAIL: %s: %lu allocations, expected %lu\n", What, Got, Expected);
+    ++Failures;
+  }
+}
+
+static FILE *openSource(const char *Src) {
+  FILE *F = fmemopen((void *)Src, strlen(Src), "r");
+  setLexerInput(F, "<test>");
+  return F;
+}
+
+// 对所有token做词法分析，返回期间的分配次数
+static unsigned long countLexAllocs(const char *Src) {
+  FILE *F = openSource(Src);
+  NumAllocs = 0;
+  Counting = true;
+  while (getNextToken() != tok_eof) {
+  }
+  Counting = false;
+  fclose(F);
+  return NumAllocs;
+}
+
+// 解析一个item，返回期间的分配次数。和MainLoop中一样，item的第一个token
+// 在解析之前就已经读入。Out不为空时保存解析结果
+template <typename ParseFn>
+static unsigned long countParseAllocs(const char *Src, ParseFn Parse,
+                                      decltype(Parse()) *Out = nullptr) {
+  FILE *F = openSource(Src);
+  getNextToken();
+  NumAllocs = 0;
+  Counting = true;
+  auto Result = Parse();
+  Counting = false;
+  fclose(F);
+  if (!Result) {
+    printf("FAIL: cannot parse '%s'\n", Src);
+    ++Failures;
+  }
+  if (Out) {
+    *Out = std::move(Result);
+  }
+  return NumAllocs;
+}
+
+int main() {
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['*'] = 40;
+  // 函数表的扩容是均摊的，不计入单个定义的分配次数
+  FunctionProtos.reserve(64);
+  // 短字符串优化的长度取决于标准库（libstdc++中为15，libc++中为22），
+  // 长名字按当前标准库生成，并在开始计数之前构造好
+  const size_t SSOLength = std::string().capacity();
+  const std::string LongName(SSOLength + 1, 'n');
+  const std::string LongParam(SSOLength + 1, 'p');
+  const std::string LongDef = "def " + LongName + "(" + LongParam + ") " +
+                              LongParam;
+
+  check("short identifiers, numbers and operators",
+        countLexAllocs("def extern foo x1 ( 1.5 , 42 ) + * < ; # comment\n"
+                       "bar 3.25"),
+        0);
+  check("one identifier longer than the SSO length",
+        countLexAllocs(LongName.c_str()), 1);
+
+  // 7个表达式节点（x, y, *, x, 2, f(...), +），PrototypeAST与FunctionAST，
+  // 原型与调用的参数列表各有2个元素（各分配2次），f在FunctionIDs中的节点
+  check("def f(x y) x*y + f(x, 2)",
+        countParseAllocs("def f(x y) x*y + f(x, 2)", ParseDefinition),
+        7 + 2 + 2 + 2 + 1);
+
+  // f已经在FunctionIDs中：3个表达式节点，PrototypeAST与FunctionAST
+  check("def f() 1 + 2",
+        countParseAllocs("def f() 1 + 2", ParseDefinition), 3 + 2);
+
+  // 超出短字符串优化长度的名字：三个标识符token各一次，FunctionIDs中的节点
+  // 及其中复制的函数名，1个表达式节点，参数列表，PrototypeAST与FunctionAST
+  check("def with names longer than the SSO length",
+        countParseAllocs(LongDef.c_str(), ParseDefinition),
+        3 + 2 + 1 + 1 + 2);
+
+  // 参数列表按2的幂增长：5个参数时容量为1、2、4、8时各分配一次。
+  // 另有1个表达式节点，PrototypeAST与FunctionAST，g在FunctionIDs中的节点
+  check("def g(a b c d e) a",
+        countParseAllocs("def g(a b c d e) a", ParseDefinition),
+        4 + 1 + 2 + 1);
+
+  // 参数列表，PrototypeAST，sin在FunctionIDs中的节点
+  std::unique_ptr<PrototypeAST> Sin;
+  check("extern sin(x)", countParseAllocs("extern sin(x)", ParseExtern, &Sin),
+        1 + 1 + 1);
+  FunctionProtos[Sin->getID()] = std::move(Sin);
+
+  // 4个表达式节点，调用的参数列表，PrototypeAST与FunctionAST，
+  // 以及__anon_expr第一次出现时在FunctionIDs中的节点
+  check("sin(1) * 2", countParseAllocs("sin(1) * 2", ParseTopLevelExpr),
+        4 + 1 + 2 + 1);
+  check("sin(2)", countParseAllocs("sin(2)", ParseTopLevelExpr), 2 + 1 + 2);
+
+  return Failures ? 1 : 0;
+}
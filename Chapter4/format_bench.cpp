@@ -0,0 +1,57 @@
+// 比较批处理模式输出结果的两种方式每秒能格式化多少个double：
+// toy.cpp中基于to_chars的PrintResults，以及逐个fprintf("%f")。
+// 输出写到/dev/null，只测量格式化与写出的开销。编译与运行：
+//   clang++ -O2 format_bench.cpp `llvm-config --cxxflags --ldflags
+//     --system-libs --libs core orcjit native` -std=c++17 -o format_bench
+//   ./format_bench [number of values]
+#define main toy_main
+#include "toy.cpp"
+#undef main
+
+#include <chrono>
+#include <cstdlib>
+
+template <typename Fn> static double measureSeconds(Fn F) {
+  auto Start = std::chrono::steady_clock::now();
+  F();
+  std::chrono::duration<double> D = std::chrono::steady_clock::now() - Start;
+  return D.count();
+}
+
+int main(int argc, char **argv) {
+  size_t N = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+
+  // 整数、短小数与需要17位有效数字的值混合
+  std::vector<double> Values(N);
+  for (size_t i = 0; i != N; ++i) {
+    switch (i % 3) {
+    case 0:
+      Values[i] = (double)i;
+      break;
+    case 1:
+      Values[i] = i * 0.25;
+      break;
+    default:
+      Values[i] = 1.0 / (i + 1);
+      break;
+    }
+  }
+
+  if (!freopen("/dev/null", "w", stderr)) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  double ToChars = measureSeconds([&] { PrintResults(Values); });
+  double Printf = measureSeconds([&] {
+    for (double V : Values) {
+      fprintf(stderr, "Evaluated to %f\n", V);
+    }
+  });
+
+  printf("%zu values\n", N);
+  printf("  to_chars: %12.0f values/s\n", N / ToChars);
+  printf("  fprintf:  %12.0f values/s\n", N / Printf);
+  printf("  speedup:  %12.2fx\n", Printf / ToChars);
+  return 0;
+}
@@ -0,0 +1,2150 @@
+#include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <signal.h>
+#include <string>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Lexer
+//===----------------------------------------------------------------------===//
+
+// return its ASCII value([0-255]) if the character is unknown
+enum Token {
+  // end of file
+  tok_eof = -1,
+
+  // commands
+  tok_def = -2,
+  tok_extern = -3,
+
+  // primary
+  tok_identifier = -4,
+  tok_number = -5,
+};
+
+static std::string IdentifierStr; // Fill in if tok_identifier
+static double NumVal;             // Fill in if tok_number
+
+// 源码中的位置，用于生成调试信息中的行号
+struct SourceLocation {
+  int Line;
+  int Col;
+};
+static SourceLocation CurLoc;           // 当前token的起始位置
+static SourceLocation LexLoc = {1, 0}; // 下一个读入字符的位置
+
+static FILE *Input = stdin;              // 正在读入的源码
+static std::string InputName = "<stdin>"; // 用于调试信息中的文件名
+static int LastChar = ' ';               // 已读入但还未处理的字符
+
+// 读入一个字符，同时更新LexLoc
+static int advance() {
+  int C = getc(Input);
+
+  if (C == '\n' || C == '\r') {
+    LexLoc.Line++;
+    LexLoc.Col = 0;
+  } else {
+    LexLoc.Col++;
+  }
+  return C;
+}
+
+// 从头开始读入另一个文件（例如先读入prelude，再读入标准输入）
+static void setLexerInput(FILE *F, std::string Name) {
+  Input = F;
+  InputName = std::move(Name);
+  LexLoc = {1, 0};
+  LastChar = ' ';
+}
+
+static int get_tok() {
+  // skip whitespace
+  while (isspace(LastChar)) {
+    LastChar = advance();
+  }
+
+  CurLoc = LexLoc;
+
+  // for identifiers of keyword "def", "extern"
+  if (isalpha(LastChar)) {
+    IdentifierStr = LastChar;
+    while (isalnum((LastChar = advance()))) {
+      IdentifierStr += LastChar;
+    }
+
+    if (IdentifierStr == "def") {
+      return tok_def;
+    }
+    if (IdentifierStr == "extern") {
+      return tok_extern;
+    }
+
+    return tok_identifier;
+  }
+
+  // for numbers, cannot handle inputs like "1.23.45.67"
+  if (isdigit(LastChar) || LastChar == '.') {
+    static std::string NumStr; // 复用缓冲区，数字token不需要分配内存
+    NumStr.clear();
+    do {
+      NumStr += LastChar;
+      LastChar = advance();
+    } while (isdigit(LastChar) || LastChar == '.');
+
+    NumVal = strtod(NumStr.c_str(), 0);
+    return tok_number;
+  }
+
+  // for comments
+  if (LastChar == '#') {
+    do {
+      LastChar = advance();
+    } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+
+    if (LastChar != EOF) {
+      return get_tok(); // read the next unit
+    }
+  }
+
+  // if dont match, it is either operators like '+' or EOF
+  if (LastChar == EOF) {
+    return tok_eof;
+  }
+
+  int ThisChar = LastChar;
+  LastChar = advance();
+  return ThisChar;
+}
+
+//===----------------------------------------------------------------------===//
+// Abstract Syntax Tree
+//===----------------------------------------------------------------------===//
+namespace {
+
+class PrototypeAST;
+
+// 所有表达式节点的基类
+class ExprAST {
+  SourceLocation Loc;
+
+public:
+  ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
+  virtual ~ExprAST() = default;
+  virtual Value *codegen() = 0;
+  // 将表达式中（包括通过函数调用）实际用到的Proto参数在Live中标记为true
+  virtual void markLiveArgs(const PrototypeAST &Proto,
+                            std::vector<bool> &Live) = 0;
+  int getLine() const { return Loc.Line; }
+  int getCol() const { return Loc.Col; }
+};
+
+// 数字字面值（如123.0）的表达式类
+class NumberExprAST : public ExprAST {
+  double Val;
+
+public:
+  NumberExprAST(double Val) : Val(Val) {}
+  Value *codegen() override;
+  void markLiveArgs(const PrototypeAST &, std::vector<bool> &) override {}
+};
+
+// 用于表示变量的表达式类。变量在解析时已经解析为所在函数的参数槽位
+class VariableExprAST : public ExprAST {
+  unsigned Slot;
+
+public:
+  VariableExprAST(SourceLocation Loc, unsigned Slot)
+      : ExprAST(Loc), Slot(Slot) {}
+  Value *codegen() override;
+  void markLiveArgs(const PrototypeAST &Proto,
+                    std::vector<bool> &Live) override;
+};
+
+// 用于表示二元操作符的类
+class BinaryExprAST : public ExprAST {
+  char Op;
+  std::unique_ptr<ExprAST> LHS, RHS;
+
+public:
+  BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
+                std::unique_ptr<ExprAST> RHS)
+      : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  Value *codegen() override;
+  void markLiveArgs(const PrototypeAST &Proto,
+                    std::vector<bool> &Live) override;
+};
+
+// 用于表示函数调用的类。被调函数在解析时已经解析为函数ID，参数数量也已检查
+class CallExprAST : public ExprAST {
+  unsigned CalleeID;
+  std::vector<std::unique_ptr<ExprAST>> Args;
+
+public:
+  CallExprAST(SourceLocation Loc, unsigned CalleeID,
+              std::vector<std::unique_ptr<ExprAST>> Args)
+      : ExprAST(Loc), CalleeID(CalleeID), Args(std::move(Args)) {}
+  Value *codegen() override;
+  void markLiveArgs(const PrototypeAST &Proto,
+                    std::vector<bool> &Live) override;
+};
+
+// 表示函数的"prototype"，即函数的名称，函数变量的名称与数量
+class PrototypeAST {
+  std::string Name;
+  std::vector<std::string> Args;
+  unsigned ID; // 函数ID，同名的函数（包括重新定义的函数）ID相同
+  bool Pure = false; // 函数体已知不访问内存，并且一定会返回
+  int Line;
+  // 函数体实际用到的参数，为空时（如extern）认为所有参数都被用到
+  std::vector<bool> LiveArgs;
+
+public:
+  PrototypeAST(SourceLocation Loc, std::string Name,
+               std::vector<std::string> Args, unsigned ID)
+      : Name(std::move(Name)), Args(std::move(Args)), ID(ID),
+        Line(Loc.Line) {}
+
+  Function *codegen();
+  const std::string &getName() const { return Name; }
+  unsigned getID() const { return ID; }
+  const std::vector<std::string> &getArgs() const { return Args; }
+  int getLine() const { return Line; }
+  size_t getNumArgs() const { return Args.size(); }
+  bool isPure() const { return Pure; }
+  void setPure() { Pure = true; }
+  bool isArgLive(unsigned Idx) const {
+    return LiveArgs.empty() || LiveArgs[Idx];
+  }
+  void setLiveArgs(std::vector<bool> Live) { LiveArgs = std::move(Live); }
+};
+
+// 表示函数的定义
+class FunctionAST {
+  std::unique_ptr<PrototypeAST> Proto;
+  std::unique_ptr<ExprAST> Body; // TODO: 为什么一个ExprAST就可以表示body？
+
+public:
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
+              std::unique_ptr<ExprAST> Body)
+      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+  Function *codegen();
+  // 在当前插入点直接生成函数体，参数取ArgsV中的值
+  Value *codegenInline(ArrayRef<Value *> ArgsV);
+  const std::string &getName() const { return Proto->getName(); }
+  unsigned getID() const { return Proto->getID(); }
+  std::vector<bool> computeLiveArgs();
+};
+} // namespace
+
+//===----------------------------------------------------------------------===//
+// Function Table
+//===----------------------------------------------------------------------===//
+
+// 函数名在解析时就被解析为函数ID，之后的各个阶段都用ID直接索引数组，
+// 只有解析器需要按名字查找
+static std::map<std::string, unsigned> FunctionIDs;
+
+// 每个函数当前的原型（def或extern），以函数ID为下标，尚未声明的函数为空。
+// 每个函数都放在单独的模块中交给JIT，新的模块根据它重新声明这个函数
+static std::vector<std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+// 返回函数名对应的ID，第一次遇到时分配新的ID（只有这时才复制函数名）
+static unsigned getFunctionID(const std::string &Name) {
+  auto Result = FunctionIDs.try_emplace(Name, FunctionProtos.size());
+  if (Result.second) {
+    FunctionProtos.emplace_back();
+  }
+  return Result.first->second;
+}
+
+//===----------------------------------------------------------------------===//
+// Parser
+//===----------------------------------------------------------------------===//
+
+// 解析器尽量不复制token：标识符直接从IdentifierStr中move出来（lexer每次都会
+// 重新赋值），AST节点的成员也都通过move构造。解析一个定义时的堆分配只有：
+//   - 每个AST节点一次，包括PrototypeAST与FunctionAST
+//   - 每个调用的参数列表、原型的参数列表各一个vector，容量按2的幂增长，
+//     n个元素时分配ceil(log2(n)) + 1次
+//   - 超出短字符串优化长度（libstdc++中为15个字符，libc++中为22个）的
+//     标识符token各一次（不超过该长度的两倍时）
+//   - 第一次出现的函数名在FunctionIDs中的一个节点，名字超出短字符串优化长度时
+//     还要复制一次。FunctionProtos的扩容是均摊的，不计入
+// 数字、运算符等其他token不分配内存。alloc_test.cpp检查这些数字
+
+static int CurTok;
+static int getNextToken() { return CurTok = get_tok(); }
+
+// 出错之后跳过一个token继续解析。def与extern总是开始下一个item，不跳过
+static void SkipTokenForErrorRecovery() {
+  if (CurTok != tok_def && CurTok != tok_extern) {
+    getNextToken();
+  }
+}
+
+// 保存已定义的二元运算符的优先级
+static std::map<char, int> BinopPrecedence;
+
+// 正在解析的函数体所属的原型，变量引用在它的参数列表中解析为槽位
+static const PrototypeAST *CurProto = nullptr;
+
+static cl::opt<unsigned>
+    MaxASTNodes("max-ast-nodes",
+                cl::desc("Reject definitions and expressions with more than "
+                         "this many AST nodes (0 = unlimited)"));
+
+// 当前top-level item（定义或表达式）中已经解析的AST节点数，以及所有item的总数
+static unsigned NumASTNodes;
+static uint64_t TotalASTNodes;
+
+std::unique_ptr<ExprAST> LogError(const char *Str) {
+  fprintf(stderr, "Error: %s\n", Str);
+  return nullptr;
+}
+
+std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+static std::unique_ptr<ExprAST> ParseExpression();
+
+// numberexpr ::= number
+// 当前token为tok_number时，新建一个NumberExprAST节点并返回
+static std::unique_ptr<ExprAST> ParseNumberExpr() {
+  auto Result = std::make_unique<NumberExprAST>(NumVal);
+  getNextToken();
+  return Result;
+}
+
+// parenexpr ::= ( expression )
+// 处理括号。括号本身不会新建AST节点
+static std::unique_ptr<ExprAST> ParseParenExpr() {
+  getNextToken(); // eat '('
+  auto V = ParseExpression();
+  if (!V) {
+    return nullptr;
+  }
+  // 这里展示了如何使用LogError
+  if (CurTok != ')') {
+    return LogError("expected ')'");
+  }
+  getNextToken(); // eat ')'
+
+  return V;
+}
+
+// identifierexpr
+//    ::= identifier
+//    ::= identifier ( expression* )
+// 处理变量引用（variable reference）与函数调用
+static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
+  std::string IdName = std::move(IdentifierStr);
+  SourceLocation LitLoc = CurLoc;
+  getNextToken();
+
+  // 普通的变量引用
+  if (CurTok != '(') {
+    if (CurProto) {
+      auto &ArgNames = CurProto->getArgs();
+      auto I = std::find(ArgNames.begin(), ArgNames.end(), IdName);
+      if (I != ArgNames.end()) {
+        return std::make_unique<VariableExprAST>(LitLoc, I - ArgNames.begin());
+      }
+    }
+    return LogError("Unknown variable name");
+  }
+
+  // 函数调用
+  getNextToken();
+  std::vector<std::unique_ptr<ExprAST>> Args;
+  if (CurTok != ')') {
+    while (true) {
+      if (auto Arg = ParseExpression()) {
+        Args.push_back(std::move(Arg));
+      } else {
+        return nullptr;
+      }
+
+      if (CurTok == ')') {
+        break;
+      }
+
+      if (CurTok != ',') {
+        return LogError("expected ')' or ',' in argument list");
+      }
+      getNextToken(); // Eat ','
+    }
+  }
+
+  getNextToken(); // Eat ')'
+
+  // 递归调用正在定义的函数时，它的原型还不在FunctionProtos中
+  const PrototypeAST *CalleeProto = nullptr;
+  if (CurProto && CurProto->getName() == IdName) {
+    CalleeProto = CurProto;
+  } else {
+    auto FI = FunctionIDs.find(IdName);
+    if (FI != FunctionIDs.end()) {
+      CalleeProto = FunctionProtos[FI->second].get();
+    }
+  }
+
+  if (!CalleeProto) {
+    return LogError("Unknown function referenced");
+  }
+  if (CalleeProto->getNumArgs() != Args.size()) {
+    return LogError("Incorrect # arguments passed");
+  }
+
+  return std::make_unique<CallExprAST>(LitLoc, CalleeProto->getID(),
+                                       std::move(Args));
+}
+
+// primary expression
+//   ::= identifier expression
+//   ::= number expression
+//   ::= paren expression
+static std::unique_ptr<ExprAST> ParsePrimary() {
+  // 超出配额时跳过这个item余下的token（直到';'或下一个def/extern），
+  // 而不是逐个token报错
+  if (++NumASTNodes > MaxASTNodes && MaxASTNodes) {
+    while (CurTok != ';' && CurTok != tok_def && CurTok != tok_extern &&
+           CurTok != tok_eof) {
+      getNextToken();
+    }
+    return LogError("Too many AST nodes (see -max-ast-nodes)");
+  }
+
+  switch (CurTok) {
+  case tok_identifier:
+    return ParseIdentifierExpr();
+  case tok_number:
+    return ParseNumberExpr();
+  case '(':
+    return ParseParenExpr();
+  default:
+    return LogError("unknown token when expecting an expression");
+  }
+}
+
+static int GetTokPrecedence() {
+  if (!isascii(CurTok)) {
+    return -1;
+  }
+
+  // 确保操作符已经声明在了map中
+  int TokPrec = -1;
+  if (BinopPrecedence.find(CurTok) != BinopPrecedence.end()) {
+    TokPrec = BinopPrecedence[CurTok];
+  }
+
+  return TokPrec;
+}
+
+// binoprhs
+//   ::= ()'+' primary)*
+// Any sequence of pairs whose operators are all higher precedence
+// than “+” should be parsed together and returned as “RHS”
+static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
+                                              std::unique_ptr<ExprAST> LHS) {
+  while (true) {
+    int TokPrec = GetTokPrecedence();
+    if (TokPrec < ExprPrec) {
+      return LHS;
+    }
+
+    int BinOp = CurTok;
+    SourceLocation BinLoc = CurLoc;
+    getNextToken(); // eat the binary operator
+
+    auto RHS = ParsePrimary();
+    if (!RHS) {
+      return nullptr;
+    }
+
+    int NextPrec = GetTokPrecedence();
+
+    // 如果下一个运算符的优先级更高，需要优先处理
+    if (TokPrec < NextPrec) {
+      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS)); // why +1?
+      if (!RHS) {
+        return nullptr;
+      }
+    }
+    // TokPrec + 1的原因：
+    // 在诸如 "a + b * c + d * e"的情况，如果不 + 1，则在解析完b * c之后，
+    // 还会继续将后面的内容添加到RHS中
+
+    ++NumASTNodes;
+    LHS = std::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS),
+                                          std::move(RHS));
+  }
+}
+
+// operator precedence parsing：将可能有具有二义性的操作符的表达式分解为多个部分
+// 例如，对于表达式"a+b+(c+d)*e*f+g"，首先解析primary expr "a"，
+// 之后它将看到多个pair：[+, b] [+, (c+d)] [*, e] [*, f] and [+, g]
+// expression
+//   ::=primary binoprhs
+// binoprhs是一个pair [binary operator, primary expression]
+static std::unique_ptr<ExprAST> ParseExpression() {
+  auto LHS = ParsePrimary();
+  if (!LHS) {
+    return nullptr;
+  }
+
+  return ParseBinOpRHS(0, std::move(LHS));
+}
+
+// prototype
+//   ::= id ( id * )
+static std::unique_ptr<PrototypeAST> ParsePrototype() {
+  if (CurTok != tok_identifier) {
+    return LogErrorP("Expected function name in prototype");
+  }
+
+  std::string FuncName = std::move(IdentifierStr);
+  SourceLocation FnLoc = CurLoc;
+  getNextToken();
+
+  if (CurTok != '(') {
+    return LogErrorP("Expected '(' in function prototype");
+  }
+
+  std::vector<std::string> ArgNames;
+  while (getNextToken() == tok_identifier) {
+    ArgNames.push_back(std::move(IdentifierStr));
+  }
+
+  if (CurTok != ')') {
+    return LogErrorP("expected ')'");
+  }
+
+  getNextToken(); // eat ')'
+
+  // 先取得ID，FuncName随后被move进原型
+  unsigned ID = getFunctionID(FuncName);
+  return std::make_unique<PrototypeAST>(FnLoc, std::move(FuncName),
+                                        std::move(ArgNames), ID);
+}
+
+// function definition ::= 'def' prototype expression
+// TODO: 目前只能parse函数只有一行的情况
+static std::unique_ptr<FunctionAST> ParseDefinition() {
+  getNextToken(); // eat 'def'
+
+  auto Proto = ParsePrototype();
+  if (!Proto) {
+    return nullptr;
+  }
+
+  CurProto = Proto.get();
+  auto E = ParseExpression();
+  CurProto = nullptr;
+  if (E) {
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  }
+  return nullptr;
+}
+
+// external ::= 'def' prototype
+static std::unique_ptr<PrototypeAST> ParseExtern() {
+  getNextToken();
+  return ParsePrototype();
+}
+
+// toplevelexpr ::= expression
+static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+  // Make an anonymous proto
+  auto Proto = std::make_unique<PrototypeAST>(
+      CurLoc, "__anon_expr", std::vector<std::string>(),
+      getFunctionID("__anon_expr"));
+
+  if (auto E = ParseExpression()) {
+    return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+  }
+
+  return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation Globals
+//===----------------------------------------------------------------------===//
+
+static std::unique_ptr<LLVMContext> TheContext;
+static std::unique_ptr<Module> TheModule;
+static std::unique_ptr<IRBuilder<>> Builder;
+// 当前函数的参数，以参数槽位为下标
+static std::vector<Value *> ArgValues;
+static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static std::unique_ptr<orc::LLJIT> TheJIT;
+// 新的定义与表达式所在的JITDylib：读入prelude时为PreludeJD，之后为主JITDylib
+static orc::JITDylib *CurJD;
+// 保存prelude中定义的只读JITDylib，主JITDylib链接到它；没有prelude时为空
+static orc::JITDylib *PreludeJD;
+static ExitOnError ExitOnErr;
+
+// 已经交给JIT的函数定义。重新定义一个函数时，调用了它的函数中保存的仍然是
+// 旧定义的地址，因此需要根据保存的AST重新编译所有（传递地）依赖它的定义
+namespace {
+struct DefinitionInfo {
+  std::unique_ptr<FunctionAST> AST;
+  std::set<unsigned> Callees;
+  orc::ResourceTrackerSP RT; // 从JIT中删除之后、重新编译之前为空
+};
+} // namespace
+static std::map<unsigned, DefinitionInfo> Definitions;
+
+// 没有参数的纯函数定义被当作命名常量，缓存它们的值。对它们的调用直接
+// 生成为缓存的值；重新定义一个常量时只重新计算依赖于它的常量
+static std::map<unsigned, double> ConstantValues;
+// 当前函数调用的函数的ID，在生成代码时记录，包括被替换为缓存值的常量。
+// 之后的阶段据此得到依赖关系，不需要再按函数名查找
+static std::set<unsigned> CalleeIDs;
+
+// 批处理模式的-fuse：对已定义函数的调用直接展开为被调函数的函数体，
+// 多个公式共用的参数与子表达式由GVN合并，只计算一次
+static bool FuseCalls = false;
+// 限制展开的深度，避免调用树很深时代码膨胀
+static const unsigned MaxFuseDepth = 8;
+static unsigned FuseDepth = 0;
+
+// 当前模块中每个函数的声明或定义，以函数ID为下标
+static std::vector<Function *> ModuleFunctions;
+
+//===----------------------------------------------------------------------===//
+// Debug Info Support
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    EmitDebugInfo("g", cl::desc("Emit DWARF line info for JIT'd code and "
+                                "register it with GDB and perf"));
+
+// 只在-g时创建，与TheModule一一对应
+static std::unique_ptr<DIBuilder> DBuilder;
+
+struct DebugInfo {
+  DICompileUnit *TheCU = nullptr;
+  DISubprogram *CurSP = nullptr; // 当前正在生成的函数
+
+  DIType *getType(Type *Ty);
+  void emitLocation(ExprAST *AST);
+  void emitFunction(Function *F, int Line);
+} KSDbgInfo;
+
+DIType *DebugInfo::getType(Type *Ty) {
+  if (Ty->isPointerTy()) {
+    // 唯一用到的指针是批处理函数的double *Out
+    return DBuilder->createPointerType(
+        getType(Type::getDoubleTy(Ty->getContext())), 64);
+  }
+  if (Ty->isVoidTy()) {
+    return nullptr;
+  }
+  return DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
+}
+
+// 之后生成的指令都对应AST所在的行与列，AST为空时清除位置
+void DebugInfo::emitLocation(ExprAST *AST) {
+  if (!DBuilder) {
+    return;
+  }
+  if (!AST) {
+    return Builder->SetCurrentDebugLocation(DebugLoc());
+  }
+  Builder->SetCurrentDebugLocation(DILocation::get(
+      CurSP->getContext(), AST->getLine(), AST->getCol(), CurSP));
+}
+
+// 为F创建DISubprogram，并描述它的参数。需要在创建entry块之后调用
+void DebugInfo::emitFunction(Function *F, int Line) {
+  if (!DBuilder) {
+    return;
+  }
+
+  DIFile *Unit = TheCU->getFile();
+  SmallVector<Metadata *, 8> Types = {getType(F->getReturnType())};
+  for (auto &Arg : F->args()) {
+    Types.push_back(getType(Arg.getType()));
+  }
+  DISubroutineType *FnTy =
+      DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(Types));
+
+  CurSP = DBuilder->createFunction(
+      Unit, F->getName(), StringRef(), Unit, Line, FnTy, Line,
+      DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+  F->setSubprogram(CurSP);
+
+  // 参数都是SSA值，没有alloca，因此使用dbg.value描述
+  emitLocation(nullptr);
+  for (auto &Arg : F->args()) {
+    DILocalVariable *D = DBuilder->createParameterVariable(
+        CurSP, Arg.getName(), Arg.getArgNo() + 1, Unit, Line,
+        getType(Arg.getType()), /*AlwaysPreserve=*/true);
+    DBuilder->insertDbgValueIntrinsic(
+        &Arg, D, DBuilder->createExpression(),
+        DILocation::get(CurSP->getContext(), Line, 0, CurSP),
+        Builder->GetInsertBlock());
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Parameter Usage Analysis
+//===----------------------------------------------------------------------===//
+
+void VariableExprAST::markLiveArgs(const PrototypeAST &,
+                                   std::vector<bool> &Live) {
+  Live[Slot] = true;
+}
+
+void BinaryExprAST::markLiveArgs(const PrototypeAST &Proto,
+                                 std::vector<bool> &Live) {
+  LHS->markLiveArgs(Proto, Live);
+  RHS->markLiveArgs(Proto, Live);
+}
+
+// 只有传给被调函数中被用到的参数的实参才算用到。递归调用使用当前的分析结果
+void CallExprAST::markLiveArgs(const PrototypeAST &Proto,
+                               std::vector<bool> &Live) {
+  std::vector<bool> CalleeLive;
+  if (CalleeID == Proto.getID()) {
+    CalleeLive = Live;
+  } else if (auto &CalleeProto = FunctionProtos[CalleeID]) {
+    for (unsigned i = 0, e = CalleeProto->getNumArgs(); i != e; ++i) {
+      CalleeLive.push_back(CalleeProto->isArgLive(i));
+    }
+  }
+
+  // 未知的函数或参数数量不匹配时保守地认为实参都被用到
+  bool Known = CalleeLive.size() == Args.size();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    if (!Known || CalleeLive[i]) {
+      Args[i]->markLiveArgs(Proto, Live);
+    }
+  }
+}
+
+// 从所有参数都未用到开始迭代到不动点，递归调用中的参数只有在别处被用到时才算用到
+std::vector<bool> FunctionAST::computeLiveArgs() {
+  std::vector<bool> Live(Proto->getNumArgs(), false);
+  while (true) {
+    std::vector<bool> NewLive = Live;
+    Body->markLiveArgs(*Proto, NewLive);
+    if (NewLive == Live) {
+      return Live;
+    }
+    Live = std::move(NewLive);
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Code Generation
+//===----------------------------------------------------------------------===//
+
+Value *LogErrorV(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+// 函数ID通过（传递的）调用能否到达Target
+static bool reachesFunction(unsigned From, unsigned Target,
+                            std::set<unsigned> &Visited) {
+  if (From == Target) {
+    return true;
+  }
+  if (!Visited.insert(From).second) {
+    return false;
+  }
+
+  auto DI = Definitions.find(From);
+  if (DI == Definitions.end()) {
+    return false;
+  }
+  for (unsigned Callee : DI->second.Callees) {
+    if (reachesFunction(Callee, Target, Visited)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// 函数体中只调用了不访问内存的函数（即其他纯函数）时，该函数本身也是纯函数。
+// extern声明的函数（如sin）行为未知，因此不算纯函数。递归的函数（包括重新定义
+// 之后形成的相互递归）不一定会返回，也不算纯函数
+static bool isPureFunction(Function &F, unsigned ID) {
+  for (Instruction &I : instructions(F)) {
+    if (auto *CI = dyn_cast<CallInst>(&I)) {
+      Function *CalleeF = CI->getCalledFunction();
+      if (!CalleeF || !CalleeF->doesNotAccessMemory()) {
+        return false;
+      }
+    }
+  }
+
+  std::set<unsigned> Visited;
+  for (unsigned Callee : CalleeIDs) {
+    if (reachesFunction(Callee, ID, Visited)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 纯函数的声明与定义都带上这些属性，相同的调用可以被GVN合并，
+// 结果用不到的调用可以被删除
+static void setPureAttrs(Function *F) {
+  F->setDoesNotAccessMemory();
+  F->setDoesNotThrow();
+  F->addFnAttr(Attribute::WillReturn);
+}
+
+static Function *&getModuleFunction(unsigned ID) {
+  if (ModuleFunctions.size() < FunctionProtos.size()) {
+    ModuleFunctions.resize(FunctionProtos.size());
+  }
+  return ModuleFunctions[ID];
+}
+
+// 先在当前模块中查找函数，找不到时根据保存的原型重新声明
+static Function *getFunction(unsigned ID) {
+  auto &P = FunctionProtos[ID];
+  if (!P) {
+    return nullptr;
+  }
+
+  // 模块中的声明可能来自函数以不同的参数数量重新定义之前
+  if (Function *F = getModuleFunction(ID)) {
+    if (F->arg_size() != P->getNumArgs()) {
+      return (Function *)LogErrorV("Stale declaration with a different # of "
+                                   "arguments");
+    }
+    return F;
+  }
+
+  return P->codegen();
+}
+
+Value *NumberExprAST::codegen() {
+  return ConstantFP::get(*TheContext, APFloat(Val));
+}
+
+Value *VariableExprAST::codegen() { return ArgValues[Slot]; }
+
+Value *BinaryExprAST::codegen() {
+  Value *L = LHS->codegen();
+  Value *R = RHS->codegen();
+  if (!L || !R) {
+    return nullptr;
+  }
+
+  KSDbgInfo.emitLocation(this);
+  switch (Op) {
+  case '+':
+    return Builder->CreateFAdd(L, R, "addtmp");
+  case '-':
+    return Builder->CreateFSub(L, R, "subtmp");
+  case '*':
+    return Builder->CreateFMul(L, R, "multmp");
+  case '<':
+    L = Builder->CreateFCmpULT(L, R, "cmptmp");
+    // 将bool值0/1转换为0.0/1.0
+    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
+                                 "booltmp");
+  default:
+    return LogErrorV("invalid binary operator");
+  }
+}
+
+Value *CallExprAST::codegen() {
+  auto CI = ConstantValues.find(CalleeID);
+  if (CI != ConstantValues.end() && Args.empty()) {
+    CalleeIDs.insert(CalleeID);
+    return ConstantFP::get(*TheContext, APFloat(CI->second));
+  }
+
+  // 解析时已经检查过，但被调函数之后可能被删除或以不同的参数数量重新定义
+  Function *CalleeF = getFunction(CalleeID);
+  if (!CalleeF) {
+    return LogErrorV("Unknown function referenced");
+  }
+
+  if (CalleeF->arg_size() != Args.size()) {
+    return LogErrorV("Incorrect # arguments passed");
+  }
+  CalleeIDs.insert(CalleeID);
+
+  // 被调函数用不到的参数直接传入poison，不为这些实参生成代码，
+  // 其中的调用也就不会被记录为依赖
+  auto &CalleeProto = *FunctionProtos[CalleeID];
+  std::vector<Value *> ArgsV;
+  for (unsigned i = 0, e = Args.size(); i != e; ++i) {
+    if (!CalleeProto.isArgLive(i)) {
+      ArgsV.push_back(PoisonValue::get(Type::getDoubleTy(*TheContext)));
+      continue;
+    }
+    ArgsV.push_back(Args[i]->codegen());
+    if (!ArgsV.back()) {
+      return nullptr;
+    }
+  }
+
+  if (FuseCalls && FuseDepth < MaxFuseDepth) {
+    auto DI = Definitions.find(CalleeID);
+    if (DI != Definitions.end()) {
+      return DI->second.AST->codegenInline(ArgsV);
+    }
+  }
+
+  KSDbgInfo.emitLocation(this);
+  return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+}
+
+Function *PrototypeAST::codegen() {
+  // 所有参数与返回值都是double
+  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
+  FunctionType *FT =
+      FunctionType::get(Type::getDoubleTy(*TheContext), Doubles, false);
+
+  Function *F =
+      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+
+  unsigned Idx = 0;
+  for (auto &Arg : F->args()) {
+    Arg.setName(Args[Idx++]);
+  }
+
+  if (Pure) {
+    setPureAttrs(F);
+  }
+
+  getModuleFunction(ID) = F;
+  return F;
+}
+
+Function *FunctionAST::codegen() {
+  // 将原型复制一份到FunctionProtos，之后的模块可以通过它重新声明这个函数。
+  // FunctionAST自己保留原型，重新定义被调函数时可以再次生成这个函数
+  auto &P = *(FunctionProtos[Proto->getID()] =
+                  std::make_unique<PrototypeAST>(*Proto));
+  CalleeIDs.clear();
+  P.setLiveArgs(computeLiveArgs());
+  Function *TheFunction = getFunction(P.getID());
+  if (!TheFunction) {
+    return nullptr;
+  }
+
+  if (!TheFunction->empty()) {
+    return (Function *)LogErrorV("Function cannot be redefined.");
+  }
+
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
+  Builder->SetInsertPoint(BB);
+  KSDbgInfo.emitFunction(TheFunction, P.getLine());
+
+  ArgValues.clear();
+  for (auto &Arg : TheFunction->args()) {
+    ArgValues.push_back(&Arg);
+  }
+
+  Value *RetVal = Body->codegen();
+  if (!RetVal) {
+    // 函数体有错误，删除这个函数
+    TheFunction->eraseFromParent();
+    getModuleFunction(P.getID()) = nullptr;
+    return nullptr;
+  }
+
+  KSDbgInfo.emitLocation(Body.get());
+  Builder->CreateRet(RetVal);
+  verifyFunction(*TheFunction);
+  TheFPM->run(*TheFunction);
+
+  if (isPureFunction(*TheFunction, P.getID())) {
+    P.setPure();
+    setPureAttrs(TheFunction);
+  }
+
+  return TheFunction;
+}
+
+Value *FunctionAST::codegenInline(ArrayRef<Value *> ArgsV) {
+  std::vector<Value *> OldArgValues = std::move(ArgValues);
+  ArgValues.assign(ArgsV.begin(), ArgsV.end());
+
+  ++FuseDepth;
+  Value *RetVal = Body->codegen();
+  --FuseDepth;
+
+  ArgValues = std::move(OldArgValues);
+  return RetVal;
+}
+
+//===----------------------------------------------------------------------===//
+// Sampling Profiler
+//===----------------------------------------------------------------------===//
+
+// -profile模式下，SIGPROF定时采样，沿着帧指针遍历JIT生成的代码的调用栈，
+// 把样本归到各个def上。不依赖perf，退出时输出flat profile与调用图
+static cl::opt<bool>
+    ProfileMode("profile",
+                cl::desc("Sample JIT'd code with SIGPROF and print a flat "
+                         "and call-graph profile at exit"));
+
+static const int ProfileIntervalUS = 1000;
+static const unsigned MaxProfiledFunctions = 4096;
+static const unsigned MaxProfileDepth = 64;
+static const unsigned EdgeTableSize = 1 << 14;
+
+namespace {
+
+struct ProfiledSymbol {
+  uint64_t Start, End;
+  unsigned ID;
+  uint64_t Key; // 所属目标文件的ObjectKey，释放时用来删除
+};
+
+// 已发布的符号表不再修改，信号处理函数可以无锁地读。更新时发布新的表，
+// 旧的表保留到没有信号处理函数正在读符号表时才释放
+struct ProfiledSymbolTable {
+  std::vector<ProfiledSymbol> Symbols; // 按Start排序
+};
+
+class ProfilerListener : public JITEventListener {
+public:
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override;
+  void notifyFreeingObject(ObjectKey K) override;
+};
+
+} // namespace
+
+static std::atomic<const ProfiledSymbolTable *> CurSymbols;
+// 当前的表在最后，之前的表可能仍被信号处理函数读着
+static std::vector<std::unique_ptr<ProfiledSymbolTable>> SymbolTables;
+// 正在执行的信号处理函数的个数
+static std::atomic<unsigned> ActiveReaders;
+// 同名函数（重新定义的函数、每一个__anon_expr）共用一个ID
+static std::map<std::string, unsigned> ProfiledIDs;
+static std::vector<std::string> ProfiledNames;
+
+static std::atomic<uint64_t> TotalSamples, OtherSamples;
+static std::atomic<uint64_t> SelfCounts[MaxProfiledFunctions];
+static std::atomic<uint64_t> TotalCounts[MaxProfiledFunctions];
+// 调用图的边(caller, callee)，开放寻址，键为((caller << 32) | callee) + 1
+static std::atomic<uint64_t> EdgeKeys[EdgeTableSize];
+static std::atomic<uint64_t> EdgeCounts[EdgeTableSize];
+
+static ProfilerListener TheProfiler;
+
+static void publishSymbols(std::vector<ProfiledSymbol> Symbols) {
+  llvm::sort(Symbols, [](const ProfiledSymbol &A, const ProfiledSymbol &B) {
+    return A.Start < B.Start;
+  });
+  SymbolTables.push_back(std::make_unique<ProfiledSymbolTable>());
+  SymbolTables.back()->Symbols = std::move(Symbols);
+  CurSymbols.store(SymbolTables.back().get());
+
+  // 此时没有信号处理函数在读的话，之后开始的信号处理函数只能读到新的表
+  // （两边都是seq_cst），旧的表可以释放
+  if (ActiveReaders.load() == 0) {
+    SymbolTables.erase(SymbolTables.begin(), SymbolTables.end() - 1);
+  }
+}
+
+void ProfilerListener::notifyObjectLoaded(
+    ObjectKey K, const object::ObjectFile &Obj,
+    const RuntimeDyld::LoadedObjectInfo &L) {
+  const ProfiledSymbolTable *Cur = CurSymbols.load(std::memory_order_relaxed);
+  std::vector<ProfiledSymbol> Symbols;
+  if (Cur) {
+    Symbols = Cur->Symbols;
+  }
+
+  // 给调试器的目标文件中，符号地址已经是加载后的地址
+  object::OwningBinary<object::ObjectFile> DebugObjOwner =
+      L.getObjectForDebug(Obj);
+  const object::ObjectFile &DebugObj = *DebugObjOwner.getBinary();
+  for (const auto &P : object::computeSymbolSizes(DebugObj)) {
+    object::SymbolRef Sym = P.first;
+    Expected<object::SymbolRef::Type> Type = Sym.getType();
+    Expected<StringRef> Name = Sym.getName();
+    Expected<uint64_t> Addr = Sym.getAddress();
+    if (!Type || !Name || !Addr) {
+      consumeError(Type.takeError());
+      consumeError(Name.takeError());
+      consumeError(Addr.takeError());
+      continue;
+    }
+    if (*Type != object::SymbolRef::ST_Function || P.second == 0) {
+      continue;
+    }
+
+    auto IDI = ProfiledIDs.find(Name->str());
+    if (IDI == ProfiledIDs.end()) {
+      if (ProfiledNames.size() == MaxProfiledFunctions) {
+        continue;
+      }
+      IDI = ProfiledIDs.insert({Name->str(), ProfiledNames.size()}).first;
+      ProfiledNames.push_back(Name->str());
+    }
+    Symbols.push_back({*Addr, *Addr + P.second, IDI->second, K});
+  }
+
+  publishSymbols(std::move(Symbols));
+}
+
+void ProfilerListener::notifyFreeingObject(ObjectKey K) {
+  const ProfiledSymbolTable *Cur = CurSymbols.load(std::memory_order_relaxed);
+  if (!Cur) {
+    return;
+  }
+
+  std::vector<ProfiledSymbol> Symbols;
+  for (auto &Sym : Cur->Symbols) {
+    if (Sym.Key != K) {
+      Symbols.push_back(Sym);
+    }
+  }
+  publishSymbols(std::move(Symbols));
+}
+
+// 遍历调用栈需要从信号的上下文中读出PC、FP与SP，只支持以下目标
+#if defined(__x86_64__) || defined(__aarch64__)
+
+// 以下函数在信号处理函数中调用，不能分配内存或加锁
+static int lookupProfiledID(const ProfiledSymbolTable *Table, uint64_t PC) {
+  if (!Table) {
+    return -1;
+  }
+
+  auto I = std::upper_bound(
+      Table->Symbols.begin(), Table->Symbols.end(), PC,
+      [](uint64_t PC, const ProfiledSymbol &Sym) { return PC < Sym.Start; });
+  if (I == Table->Symbols.begin() || PC >= (I - 1)->End) {
+    return -1;
+  }
+  return (I - 1)->ID;
+}
+
+static void addProfileEdge(unsigned Caller, unsigned Callee) {
+  uint64_t Key = ((uint64_t)Caller << 32 | Callee) + 1;
+  size_t H = (Key * 0x9E3779B97F4A7C15ULL) >> 50;
+  for (unsigned Probe = 0; Probe != EdgeTableSize; ++Probe) {
+    uint64_t Cur = EdgeKeys[H].load(std::memory_order_relaxed);
+    if (Cur == 0 && EdgeKeys[H].compare_exchange_strong(Cur, Key)) {
+      Cur = Key;
+    }
+    if (Cur == Key) {
+      EdgeCounts[H].fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    H = (H + 1) & (EdgeTableSize - 1);
+  }
+}
+
+static void ProfileSignalHandler(int, siginfo_t *, void *Context) {
+  auto *UC = (ucontext_t *)Context;
+#if defined(__x86_64__)
+  uint64_t PC = UC->uc_mcontext.gregs[REG_RIP];
+  uint64_t FP = UC->uc_mcontext.gregs[REG_RBP];
+  uint64_t SP = UC->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  uint64_t PC = UC->uc_mcontext.pc;
+  uint64_t FP = UC->uc_mcontext.regs[29];
+  uint64_t SP = UC->uc_mcontext.sp;
+#endif
+
+  TotalSamples.fetch_add(1, std::memory_order_relaxed);
+
+  // 计数期间读到的表不会被publishSymbols释放
+  struct ReaderGuard {
+    ReaderGuard() { ActiveReaders.fetch_add(1); }
+    ~ReaderGuard() { ActiveReaders.fetch_sub(1); }
+  } Guard;
+  const ProfiledSymbolTable *Table = CurSymbols.load();
+
+  // 只有JIT生成的代码保证保留了帧指针。PC不在JIT代码中时（编译器本身、
+  // extern函数等）不遍历调用栈
+  unsigned Stack[MaxProfileDepth];
+  int Leaf = lookupProfiledID(Table, PC);
+  if (Leaf < 0) {
+    OtherSamples.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  Stack[0] = Leaf;
+  unsigned Depth = 1;
+
+  // 每个栈帧中，[FP]为调用者的FP，[FP + 8]为返回地址。
+  // 样本落在函数的prologue/epilogue中时，FP仍属于调用者，会漏掉一层调用者
+  while (Depth != MaxProfileDepth && FP >= SP && FP - SP < (1 << 20) &&
+         FP % sizeof(uint64_t) == 0) {
+    uint64_t NextFP = ((uint64_t *)FP)[0];
+    int ID = lookupProfiledID(Table, ((uint64_t *)FP)[1] - 1);
+    if (ID < 0) {
+      break;
+    }
+    Stack[Depth++] = ID;
+    SP = FP;
+    FP = NextFP;
+  }
+
+  SelfCounts[Leaf].fetch_add(1, std::memory_order_relaxed);
+  for (unsigned i = 0; i != Depth; ++i) {
+    // 递归调用时每个函数在一个样本中只计一次
+    if (std::find(Stack, Stack + i, Stack[i]) == Stack + i) {
+      TotalCounts[Stack[i]].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (i + 1 != Depth) {
+      addProfileEdge(Stack[i + 1], Stack[i]);
+    }
+  }
+}
+
+#endif
+
+static void StartProfiler() {
+#if defined(__x86_64__) || defined(__aarch64__)
+  struct sigaction SA = {};
+  SA.sa_sigaction = ProfileSignalHandler;
+  SA.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&SA.sa_mask);
+  sigaction(SIGPROF, &SA, nullptr);
+
+  struct itimerval Timer = {};
+  Timer.it_interval.tv_usec = ProfileIntervalUS;
+  Timer.it_value.tv_usec = ProfileIntervalUS;
+  setitimer(ITIMER_PROF, &Timer, nullptr);
+#else
+  fprintf(stderr, "Error: -profile is not supported on this target\n");
+#endif
+}
+
+// 停止采样。之后不会再有信号处理函数读符号表，它们可以随JIT一起释放
+static void StopProfiler() {
+  struct itimerval Timer = {};
+  setitimer(ITIMER_PROF, &Timer, nullptr);
+  signal(SIGPROF, SIG_IGN);
+}
+
+static void PrintProfile() {
+  StopProfiler();
+
+  uint64_t Total = TotalSamples.load();
+  fprintf(stderr, "\nFlat profile (%llu samples, %llu outside JIT'd code):\n",
+          (unsigned long long)Total, (unsigned long long)OtherSamples.load());
+  if (Total == 0) {
+    return;
+  }
+
+  std::vector<unsigned> IDs;
+  for (unsigned ID = 0, E = ProfiledNames.size(); ID != E; ++ID) {
+    if (TotalCounts[ID].load()) {
+      IDs.push_back(ID);
+    }
+  }
+  llvm::sort(IDs, [](unsigned A, unsigned B) {
+    return std::make_pair(SelfCounts[A].load(), TotalCounts[A].load()) >
+           std::make_pair(SelfCounts[B].load(), TotalCounts[B].load());
+  });
+  fprintf(stderr, "  %7s %7s  %s\n", "self%", "total%", "function");
+  for (unsigned ID : IDs) {
+    fprintf(stderr, "  %7.2f %7.2f  %s\n", 100.0 * SelfCounts[ID] / Total,
+            100.0 * TotalCounts[ID] / Total, ProfiledNames[ID].c_str());
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> Edges; // (count, key)
+  for (unsigned H = 0; H != EdgeTableSize; ++H) {
+    if (uint64_t Key = EdgeKeys[H].load()) {
+      Edges.push_back({EdgeCounts[H].load(), Key - 1});
+    }
+  }
+  llvm::sort(Edges, std::greater<std::pair<uint64_t, uint64_t>>());
+  fprintf(stderr, "\nCall graph:\n");
+  fprintf(stderr, "  %7s  %s\n", "calls%", "caller -> callee");
+  for (auto &Edge : Edges) {
+    fprintf(stderr, "  %7.2f  %s -> %s\n", 100.0 * Edge.first / Total,
+            ProfiledNames[Edge.second >> 32].c_str(),
+            ProfiledNames[Edge.second & 0xffffffff].c_str());
+  }
+}
+
+//===----------------------------------------------------------------------===//
+// Resource Quotas
+//===----------------------------------------------------------------------===//
+
+// 限制一个进程（即一个会话）可以使用的资源，0表示不限制。超出配额的输入
+// 被拒绝并输出错误；-usage在退出时输出各项资源的使用量
+static cl::opt<unsigned>
+    MaxCodeBytes("max-code-bytes",
+                 cl::desc("Refuse to compile new definitions and expressions "
+                          "once this many bytes of JIT'd code are loaded "
+                          "(0 = unlimited)"));
+
+static cl::opt<double> MaxCPUSeconds(
+    "max-cpu-seconds",
+    cl::desc("Refuse to compile or evaluate new definitions and expressions "
+             "once the process has used this much CPU time (0 = unlimited)"));
+
+static cl::opt<unsigned>
+    MaxEvalThreads("max-eval-threads",
+                   cl::desc("Evaluate at most this many constants "
+                            "concurrently (0 = one per hardware thread)"));
+
+static cl::opt<bool> PrintUsage("usage",
+                                cl::desc("Print resource usage at exit"));
+
+namespace {
+
+// 统计已加载的JIT代码（可执行section）的大小，释放目标文件时减去
+class CodeSizeListener : public JITEventListener {
+public:
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override;
+  void notifyFreeingObject(ObjectKey K) override;
+};
+
+} // namespace
+
+static std::map<JITEventListener::ObjectKey, uint64_t> ObjectCodeBytes;
+static uint64_t CodeBytes, PeakCodeBytes;
+static double EvalCPUSeconds; // 执行JIT代码所用的CPU时间
+
+static CodeSizeListener TheCodeSizeListener;
+
+void CodeSizeListener::notifyObjectLoaded(
+    ObjectKey K, const object::ObjectFile &Obj,
+    const RuntimeDyld::LoadedObjectInfo &) {
+  uint64_t Bytes = 0;
+  for (const object::SectionRef &Sec : Obj.sections()) {
+    if (Sec.isText()) {
+      Bytes += Sec.getSize();
+    }
+  }
+  ObjectCodeBytes[K] = Bytes;
+  CodeBytes += Bytes;
+  PeakCodeBytes = std::max(PeakCodeBytes, CodeBytes);
+}
+
+void CodeSizeListener::notifyFreeingObject(ObjectKey K) {
+  auto I = ObjectCodeBytes.find(K);
+  if (I != ObjectCodeBytes.end()) {
+    CodeBytes -= I->second;
+    ObjectCodeBytes.erase(I);
+  }
+}
+
+static double getProcessCPUSeconds() {
+  timespec TS;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// 编译新的代码之前检查配额。重新编译依赖于某个定义的代码不受限制，
+// 因为它替换的是已有的代码。JIT代码运行时无法被打断，因此CPU时间只在
+// item之间检查：超出配额时正在执行的item会运行完，之后的item被拒绝
+static bool checkQuotas() {
+  if (MaxCPUSeconds > 0 && getProcessCPUSeconds() >= MaxCPUSeconds) {
+    fprintf(stderr, "Error: CPU time exceeds %gs (see -max-cpu-seconds)\n",
+            (double)MaxCPUSeconds);
+    return false;
+  }
+  if (MaxCodeBytes && CodeBytes >= MaxCodeBytes) {
+    fprintf(stderr, "Error: JIT'd code exceeds %u bytes (see -max-code-bytes)\n",
+            (unsigned)MaxCodeBytes);
+    return false;
+  }
+  return true;
+}
+
+// 定义（传递地）调用的函数都已定义，或者是能在当前进程中找到的extern时，
+// 它才能链接。无法链接的定义在查找符号时会被ORC作为错误报告
+static bool canLink(unsigned ID, std::set<unsigned> &Visited) {
+  if (!Visited.insert(ID).second) {
+    return true;
+  }
+
+  auto DI = Definitions.find(ID);
+  if (DI == Definitions.end()) {
+    // 只查找extern本身的符号，不会编译任何代码
+    auto &P = FunctionProtos[ID];
+    if (!P) {
+      return false;
+    }
+    auto Sym = TheJIT->lookup(*CurJD, P->getName());
+    if (!Sym) {
+      consumeError(Sym.takeError());
+      return false;
+    }
+    return true;
+  }
+
+  // 已从JIT中删除、还在等待重新编译的定义暂时无法链接
+  if (!DI->second.RT) {
+    return false;
+  }
+  for (unsigned Callee : DI->second.Callees) {
+    if (!canLink(Callee, Visited)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// 加入JIT的模块要到查找符号时才编译。有代码配额时立即编译新的定义，
+// 编译之后超出配额的定义被删除。调用了尚未定义的函数的定义此时还无法链接，
+// 它会在那个函数被定义时重新编译，不受配额限制
+static bool enforceCodeQuota(unsigned ID) {
+  if (!MaxCodeBytes) {
+    return true;
+  }
+
+  std::set<unsigned> Visited;
+  if (!canLink(ID, Visited)) {
+    return true;
+  }
+
+  const std::string &Name = FunctionProtos[ID]->getName();
+  if (auto Sym = TheJIT->lookup(*CurJD, Name)) {
+    if (CodeBytes <= MaxCodeBytes) {
+      return true;
+    }
+  } else {
+    consumeError(Sym.takeError());
+    return true;
+  }
+
+  fprintf(stderr, "Error: compiling %s exceeds %u bytes of JIT'd code "
+                  "(see -max-code-bytes)\n",
+          Name.c_str(), (unsigned)MaxCodeBytes);
+  ExitOnErr(Definitions[ID].RT->remove());
+  Definitions.erase(ID);
+  return false;
+}
+
+static void PrintResourceUsage() {
+  fprintf(stderr, "\nResource usage:\n");
+  fprintf(stderr, "  AST nodes parsed: %llu\n",
+          (unsigned long long)(TotalASTNodes + NumASTNodes));
+  fprintf(stderr, "  JIT'd code bytes: %llu (peak %llu)\n",
+          (unsigned long long)CodeBytes, (unsigned long long)PeakCodeBytes);
+  fprintf(stderr, "  CPU time:         %.3fs (%.3fs evaluating)\n",
+          getProcessCPUSeconds(), EvalCPUSeconds);
+}
+
+//===----------------------------------------------------------------------===//
+// Top-Level parsing and JIT Driver
+//===----------------------------------------------------------------------===//
+
+static cl::opt<bool>
+    BatchMode("batch",
+              cl::desc("Evaluate top-level expressions in a single call at "
+                       "end of input, or before a definition replaces one "
+                       "they may call, sharing common subexpressions"));
+
+static cl::opt<std::string>
+    PreludeFile("prelude", cl::value_desc("filename"),
+                cl::desc("Compile the definitions in this file once into a "
+                         "read-only prelude before reading standard input"));
+
+static cl::opt<bool>
+    FuseDefinitions("fuse",
+                    cl::desc("In batch mode, fuse the bodies of called "
+                             "definitions into the batch function"));
+
+static cl::opt<std::string>
+    ResultsFile("results", cl::value_desc("filename"),
+                cl::desc("In batch mode, write the results to this file as "
+                         "raw little-endian doubles instead of printing them"));
+
+// 批处理模式下收集到的top-level expression，在输入结束时统一编译
+static std::vector<std::unique_ptr<ExprAST>> BatchExprs;
+// 各个批次的结果，输入结束时一次写入-results文件
+static std::vector<double> BatchResults;
+
+static void HandleBatch();
+
+static void InitializeModuleAndPassManager() {
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+  TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  ModuleFunctions.clear();
+
+  // 与官方教程相同的优化：peephole、重结合、GVN（消除公共子表达式）与CFG化简
+  TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  TheFPM->add(createInstructionCombiningPass());
+  TheFPM->add(createReassociatePass());
+  TheFPM->add(createGVNPass());
+  TheFPM->add(createCFGSimplificationPass());
+  TheFPM->doInitialization();
+
+  if (EmitDebugInfo) {
+    TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+                             DEBUG_METADATA_VERSION);
+    DBuilder = std::make_unique<DIBuilder>(*TheModule);
+    KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+        dwarf::DW_LANG_C, DBuilder->createFile(InputName, "."),
+        "Kaleidoscope Compiler", /*isOptimized=*/true, "", 0);
+  }
+}
+
+// 丢弃还没有交给JIT的模块。生成代码出错时，模块中可能留下了按旧原型生成的
+// 声明，之后的代码不能再使用。模块必须在它的LLVMContext之前销毁
+static void DiscardModule() {
+  if (DBuilder) {
+    DBuilder->finalize();
+    DBuilder.reset();
+  }
+  TheFPM.reset();
+  Builder.reset();
+  TheModule.reset();
+  InitializeModuleAndPassManager();
+}
+
+// 将当前模块交给JIT，并为后续代码准备一个新的模块
+static void AddModuleToJIT(orc::ResourceTrackerSP RT = nullptr) {
+  if (DBuilder) {
+    DBuilder->finalize();
+    DBuilder.reset();
+  }
+
+  // 采样时需要沿帧指针遍历调用栈
+  if (ProfileMode) {
+    for (Function &F : *TheModule) {
+      if (!F.isDeclaration()) {
+        F.addFnAttr("frame-pointer", "all");
+      }
+    }
+  }
+
+  auto TSM = orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
+  if (RT) {
+    ExitOnErr(TheJIT->addIRModule(RT, std::move(TSM)));
+  } else {
+    ExitOnErr(TheJIT->addIRModule(std::move(TSM)));
+  }
+  InitializeModuleAndPassManager();
+}
+
+// 编译一个定义并交给JIT，同时记录它调用了哪些函数
+static bool AddDefinitionToJIT(std::unique_ptr<FunctionAST> FnAST,
+                               bool PrintIR) {
+  Function *FnIR = FnAST->codegen();
+  if (!FnIR) {
+    DiscardModule();
+    return false;
+  }
+
+  if (PrintIR) {
+    fprintf(stderr, "Read function definition:");
+    FnIR->print(errs());
+    fprintf(stderr, "\n");
+
+    auto &P = *FunctionProtos[FnAST->getID()];
+    for (unsigned i = 0, e = P.getNumArgs(); i != e; ++i) {
+      if (!P.isArgLive(i)) {
+        fprintf(stderr, "Parameter '%s' of %s is unused\n",
+                P.getArgs()[i].c_str(), P.getName().c_str());
+      }
+    }
+  }
+
+  DefinitionInfo &Info = Definitions[FnAST->getID()];
+  Info.Callees = std::move(CalleeIDs);
+  Info.AST = std::move(FnAST);
+  Info.RT = CurJD->createResourceTracker();
+  AddModuleToJIT(Info.RT);
+  return true;
+}
+
+// 返回ID以及所有传递地依赖于它的定义，按拓扑序分层：
+// 第0层只有ID，每个定义所依赖的定义都在它之前的层中，同一层中的定义互不依赖
+static std::vector<std::vector<unsigned>> getDependentLevels(unsigned ID) {
+  std::set<unsigned> Dependents = {ID};
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (auto &Def : Definitions) {
+      if (Dependents.count(Def.first)) {
+        continue;
+      }
+      for (unsigned Callee : Def.second.Callees) {
+        if (Dependents.count(Callee)) {
+          Dependents.insert(Def.first);
+          Changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  std::vector<std::vector<unsigned>> Levels = {{ID}};
+  Dependents.erase(ID);
+  while (!Dependents.empty()) {
+    std::vector<unsigned> Level;
+    for (unsigned Dep : Dependents) {
+      bool Ready = true;
+      for (unsigned Callee : Definitions[Dep].Callees) {
+        if (Callee != Dep && Dependents.count(Callee)) {
+          Ready = false;
+          break;
+        }
+      }
+      if (Ready) {
+        Level.push_back(Dep);
+      }
+    }
+
+    // 重新定义可能引入循环依赖，剩下的定义放在最后一层
+    if (Level.empty()) {
+      Level.assign(Dependents.begin(), Dependents.end());
+    }
+    for (unsigned Dep : Level) {
+      Dependents.erase(Dep);
+    }
+    Levels.push_back(std::move(Level));
+  }
+  return Levels;
+}
+
+// 计算一层中常量的值。同一层中的常量互不依赖，可以并行求值。
+// 只有纯函数才会被自动求值：调用了extern的定义可能有副作用，仍然只在被调用时执行
+static void EvaluateConstants(const std::vector<unsigned> &Level) {
+  static ThreadPool Pool(hardware_concurrency(MaxEvalThreads));
+
+  std::vector<unsigned> IDs;
+  std::vector<double (*)()> FPs;
+  for (unsigned ID : Level) {
+    auto &P = FunctionProtos[ID];
+    if (!Definitions.count(ID) || !P->isPure() || P->getNumArgs() != 0) {
+      continue;
+    }
+    // 在当前线程中查找符号（即完成编译），只把求值交给线程池。
+    // 还无法链接的常量跳过，它会在缺少的函数被定义或重新编译时求值。
+    // 直接查找会让ORC报告缺少的符号
+    std::set<unsigned> Visited;
+    if (!canLink(ID, Visited)) {
+      continue;
+    }
+    auto Sym = TheJIT->lookup(*CurJD, P->getName());
+    if (!Sym) {
+      consumeError(Sym.takeError());
+      continue;
+    }
+    IDs.push_back(ID);
+    FPs.push_back((double (*)())(intptr_t)Sym->getAddress());
+  }
+
+  std::vector<double> Values(FPs.size());
+  double Start = getProcessCPUSeconds();
+  if (FPs.size() == 1) {
+    Values[0] = FPs[0]();
+  } else {
+    for (size_t i = 0, e = FPs.size(); i != e; ++i) {
+      Pool.async([&Values, &FPs, i] { Values[i] = FPs[i](); });
+    }
+    Pool.wait();
+  }
+  EvalCPUSeconds += getProcessCPUSeconds() - Start;
+
+  for (size_t i = 0, e = IDs.size(); i != e; ++i) {
+    ConstantValues[IDs[i]] = Values[i];
+    fprintf(stderr, "%s = %f\n", FunctionProtos[IDs[i]]->getName().c_str(),
+            Values[i]);
+  }
+}
+
+// prelude中定义或声明（extern）的函数
+static std::set<unsigned> PreludeFunctions;
+
+// prelude是只读的：读入prelude之后不能再定义或声明其中出现过的函数。
+// 否则prelude中调用了某个extern的定义会因为它被定义而被重新编译到主JITDylib中
+static bool isPreludeFunction(unsigned ID) {
+  return CurJD != PreludeJD && PreludeFunctions.count(ID);
+}
+
+static void HandleDefinition() {
+  auto FnAST = ParseDefinition();
+  if (!FnAST) {
+    // Skip token for error recovery.
+    SkipTokenForErrorRecovery();
+    return;
+  }
+
+  unsigned ID = FnAST->getID();
+  if (isPreludeFunction(ID)) {
+    LogError("Cannot define a function declared in the prelude");
+    return;
+  }
+  if (!checkQuotas()) {
+    return;
+  }
+
+  // 批处理模式下，之前收集的表达式应当使用被替换之前的定义（与逐个求值时
+  // 相同），因此替换已有的定义之前先对它们求值
+  if (BatchMode && Definitions.count(ID)) {
+    HandleBatch();
+  }
+  auto Levels = getDependentLevels(ID);
+
+  // 先从JIT中删除旧的定义以及所有依赖它的定义。即使ID之前只是extern声明，
+  // 调用了它的定义也要删除后重新编译。它们缓存的值也都失效了
+  for (auto &Level : Levels) {
+    for (unsigned Def : Level) {
+      auto DI = Definitions.find(Def);
+      if (DI != Definitions.end()) {
+        ExitOnErr(DI->second.RT->remove());
+        DI->second.RT = nullptr;
+      }
+      ConstantValues.erase(Def);
+    }
+  }
+
+  // 保留旧的定义（或extern声明）。新的定义有错误或超出配额时恢复它，
+  // 依赖它的定义在下面按原样重新编译，会话保持不变
+  std::unique_ptr<PrototypeAST> OldProto;
+  if (FunctionProtos[ID]) {
+    OldProto = std::make_unique<PrototypeAST>(*FunctionProtos[ID]);
+  }
+  std::unique_ptr<FunctionAST> OldAST;
+  auto OldDI = Definitions.find(ID);
+  if (OldDI != Definitions.end()) {
+    OldAST = std::move(OldDI->second.AST);
+    Definitions.erase(OldDI);
+  }
+
+  if (AddDefinitionToJIT(std::move(FnAST), /*PrintIR=*/true) &&
+      enforceCodeQuota(ID)) {
+    if (CurJD == PreludeJD) {
+      PreludeFunctions.insert(ID);
+    }
+  } else {
+    FunctionProtos[ID] = std::move(OldProto);
+    if (OldAST && !AddDefinitionToJIT(std::move(OldAST), /*PrintIR=*/false)) {
+      FunctionProtos[ID].reset();
+    }
+  }
+  EvaluateConstants(Levels[0]);
+
+  // 按拓扑序重新编译依赖于它的定义，出错（例如参数数量已经不匹配）的定义被删除。
+  // 每一层编译之后立即求值其中的常量，下一层中对它们的调用使用新的值
+  for (size_t L = 1; L < Levels.size(); ++L) {
+    for (unsigned Dep : Levels[L]) {
+      auto DI = Definitions.find(Dep);
+      if (DI == Definitions.end()) {
+        continue;
+      }
+      auto DepAST = std::move(DI->second.AST);
+      std::string DepName = DepAST->getName();
+      Definitions.erase(DI);
+      if (AddDefinitionToJIT(std::move(DepAST), /*PrintIR=*/false)) {
+        fprintf(stderr, "Recompiled %s\n", DepName.c_str());
+      } else {
+        fprintf(stderr, "Removed %s\n", DepName.c_str());
+        FunctionProtos[Dep].reset();
+      }
+    }
+    EvaluateConstants(Levels[L]);
+  }
+}
+
+static void HandleExtern() {
+  if (auto ProtoAST = ParseExtern()) {
+    if (isPreludeFunction(ProtoAST->getID())) {
+      LogError("Cannot declare a function declared in the prelude");
+      return;
+    }
+    if (auto *FnIR = ProtoAST->codegen()) {
+      fprintf(stderr, "Read extern: ");
+      FnIR->print(errs());
+      fprintf(stderr, "\n");
+      if (CurJD == PreludeJD) {
+        PreludeFunctions.insert(ProtoAST->getID());
+      }
+      FunctionProtos[ProtoAST->getID()] = std::move(ProtoAST);
+    }
+  } else {
+    // Skip token for error recovery.
+    SkipTokenForErrorRecovery();
+  }
+}
+
+static void HandleTopLevelExpression() {
+  // 批处理模式下只解析，输入结束时由HandleBatch统一编译与求值。
+  // prelude中的表达式总是立即求值
+  if (BatchMode && CurJD != PreludeJD) {
+    if (auto E = ParseExpression()) {
+      BatchExprs.push_back(std::move(E));
+    } else {
+      // 解析出错的表达式也占用一个结果的位置，结果为NaN
+      BatchExprs.push_back(std::make_unique<NumberExprAST>(
+          std::numeric_limits<double>::quiet_NaN()));
+      // Skip token for error recovery.
+      SkipTokenForErrorRecovery();
+    }
+    return;
+  }
+
+  // Evaluate a top-level expression into an anonymous function.
+  if (auto FnAST = ParseTopLevelExpr()) {
+    if (!checkQuotas()) {
+      return;
+    }
+    if (auto *FnIR = FnAST->codegen()) {
+      fprintf(stderr, "Read top-level expression:");
+      FnIR->print(errs());
+      fprintf(stderr, "\n");
+
+      // 使用ResourceTracker，求值之后可以把匿名函数从JIT中删除
+      auto RT = CurJD->createResourceTracker();
+      AddModuleToJIT(RT);
+
+      auto ExprSymbol = ExitOnErr(TheJIT->lookup(*CurJD, "__anon_expr"));
+      double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+      double Start = getProcessCPUSeconds();
+      double Result = FP();
+      EvalCPUSeconds += getProcessCPUSeconds() - Start;
+      fprintf(stderr, "Evaluated to %f\n", Result);
+
+      ExitOnErr(RT->remove());
+    } else {
+      DiscardModule();
+    }
+  } else {
+    // Skip token for error recovery.
+    SkipTokenForErrorRecovery();
+  }
+}
+
+// -results文件在启动时打开，无法写入时在读入任何输入之前就报错
+static std::unique_ptr<raw_fd_ostream> ResultsOS;
+
+static bool OpenResultsFile() {
+  std::error_code EC;
+  ResultsOS = std::make_unique<raw_fd_ostream>(ResultsFile, EC);
+  if (EC) {
+    fprintf(stderr, "Error: cannot open '%s': %s\n", ResultsFile.c_str(),
+            EC.message().c_str());
+    ResultsOS.reset();
+    return false;
+  }
+  return true;
+}
+
+// 结果文件的格式：8字节的magic "KSRESULT"，little-endian的uint64结果个数，
+// 之后是little-endian的double结果，按表达式在输入中的顺序排列。
+// 写入失败时返回false
+static bool WriteResults(ArrayRef<double> Results) {
+  raw_fd_ostream &OS = *ResultsOS;
+  support::endian::Writer W(OS, support::little);
+  OS << "KSRESULT";
+  W.write<uint64_t>(Results.size());
+  W.write(Results);
+
+  OS.close();
+  if (OS.has_error()) {
+    fprintf(stderr, "Error: cannot write '%s': %s\n", ResultsFile.c_str(),
+            OS.error().message().c_str());
+    OS.clear_error();
+    return false;
+  }
+  return true;
+}
+
+// 把所有结果格式化到同一个缓冲区后一次写出。to_chars输出能精确还原为同一个
+// double的最短表示，比逐个fprintf("%f")快，也不会丢失精度
+static void PrintResults(ArrayRef<double> Results) {
+  std::string Text;
+  Text.reserve(Results.size() * 40);
+  for (double Result : Results) {
+    char Buf[32];
+    auto R = std::to_chars(Buf, Buf + sizeof(Buf), Result);
+    Text += "Evaluated to ";
+    Text.append(Buf, R.ptr);
+    Text += '\n';
+  }
+  fwrite(Text.data(), 1, Text.size(), stderr);
+}
+
+// 将所有收集到的top-level expression合并到同一个函数
+//   void __anon_batch(double *Out)
+// 中，第i个表达式的结果写入Out[i]。各个表达式中相同的子表达式（包括对纯函数的
+// 相同调用）在同一个函数中由GVN合并，因此只计算一次；整个批次只编译一次，
+// 也只需要一次调用就能得到所有结果
+static void EvaluateBatch(MutableArrayRef<double> Results) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(*TheContext),
+                                       {PointerType::getUnqual(DoubleTy)},
+                                       false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, "__anon_batch",
+                                 TheModule.get());
+  Argument *Out = F->getArg(0);
+  Out->setName("out");
+
+  BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", F);
+  Builder->SetInsertPoint(BB);
+  KSDbgInfo.emitFunction(F, BatchExprs.front()->getLine());
+  ArgValues.clear();
+
+  // 每个表达式占用一个结果的位置，出错的表达式（例如被调函数在解析之后被
+  // 重新定义为不同的参数数量）的结果为NaN，之后的结果不会错位
+  unsigned NumResults = BatchExprs.size();
+  FuseCalls = FuseDefinitions;
+  for (unsigned i = 0; i != NumResults; ++i) {
+    Value *V = BatchExprs[i]->codegen();
+    if (!V) {
+      fprintf(stderr, "Error: batch expression #%u failed, its result is NaN\n",
+              (unsigned)BatchResults.size() + i + 1);
+      V = ConstantFP::getNaN(DoubleTy);
+    }
+    Builder->CreateStore(V,
+                         Builder->CreateConstInBoundsGEP1_64(DoubleTy, Out, i));
+  }
+  FuseCalls = false;
+
+  Builder->CreateRetVoid();
+  verifyFunction(*F);
+  TheFPM->run(*F);
+
+  fprintf(stderr, "Read batch of %u expressions:", NumResults);
+  F->print(errs());
+  fprintf(stderr, "\n");
+
+  auto RT = CurJD->createResourceTracker();
+  AddModuleToJIT(RT);
+
+  auto BatchSymbol = ExitOnErr(TheJIT->lookup(*CurJD, "__anon_batch"));
+  void (*FP)(double *) = (void (*)(double *))(intptr_t)BatchSymbol.getAddress();
+
+  double Start = getProcessCPUSeconds();
+  FP(Results.data());
+  EvalCPUSeconds += getProcessCPUSeconds() - Start;
+
+  ExitOnErr(RT->remove());
+}
+
+// 对收集到的表达式求值并输出结果。写入-results文件时先保存结果，
+// 由main在输入结束时统一写出
+static void HandleBatch() {
+  if (BatchExprs.empty()) {
+    return;
+  }
+
+  // 超出配额时这个批次的结果都是NaN，之后的结果同样不会错位
+  std::vector<double> Results(BatchExprs.size(),
+                              std::numeric_limits<double>::quiet_NaN());
+  if (checkQuotas()) {
+    EvaluateBatch(Results);
+  }
+  BatchExprs.clear();
+
+  if (!ResultsFile.empty()) {
+    BatchResults.insert(BatchResults.end(), Results.begin(), Results.end());
+  } else {
+    PrintResults(Results);
+  }
+}
+
+// 销毁JIT时会通知listener释放所有目标文件，而listener使用的表定义在TheJIT
+// 之后，会先于它被销毁，因此要在静态变量销毁之前先销毁JIT。
+// Definitions中的ResourceTracker必须在JIT之前释放。main在创建JIT之后用atexit
+// 注册这个函数，它先于静态变量的析构函数执行：无论是main返回还是ExitOnErr
+// 出错时调用exit都会执行
+static void DestroyJIT() {
+  // ExitOnErr出错退出时采样仍在进行
+  if (ProfileMode) {
+    StopProfiler();
+  }
+  Definitions.clear();
+  TheJIT.reset();
+}
+
+// top ::= definition | external | expression | ';'
+// top-level expression：函数体外的表达式
+static void MainLoop() {
+  while (true) {
+    fprintf(stderr, "ready> ");
+    TotalASTNodes += NumASTNodes;
+    NumASTNodes = 0;
+    switch (CurTok) {
+    case tok_eof:
+      return;
+    case ';':
+      getNextToken();
+      break;
+    case tok_def:
+      HandleDefinition();
+      break;
+    case tok_extern:
+      HandleExtern();
+      break;
+    default:
+      HandleTopLevelExpression();
+      break;
+    }
+  }
+}
+
+// 把prelude编译进单独的JITDylib。主JITDylib链接到它，标准输入中的代码
+// 可以调用prelude中的函数，但prelude的代码只编译一次，也不会被重新编译
+static void LoadPrelude() {
+  FILE *F = fopen(PreludeFile.c_str(), "r");
+  if (!F) {
+    fprintf(stderr, "Error: cannot open prelude '%s'\n", PreludeFile.c_str());
+    exit(1);
+  }
+
+  PreludeJD = &ExitOnErr(TheJIT->createJITDylib("prelude"));
+  PreludeJD->addGenerator(
+      ExitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          TheJIT->getDataLayout().getGlobalPrefix())));
+  TheJIT->getMainJITDylib().addToLinkOrder(*PreludeJD);
+
+  CurJD = PreludeJD;
+  setLexerInput(F, PreludeFile);
+  InitializeModuleAndPassManager();
+  getNextToken();
+  MainLoop();
+  fclose(F);
+
+  // 丢弃还没有交给JIT的模块，main会为标准输入重新创建（调试信息中的文件名
+  // 不同）。模块必须在它的LLVMContext之前销毁
+  DBuilder.reset();
+  TheFPM.reset();
+  TheModule.reset();
+
+  CurJD = &TheJIT->getMainJITDylib();
+  setLexerInput(stdin, "<stdin>");
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+  if (!ResultsFile.empty() && !BatchMode) {
+    fprintf(stderr, "Error: -results requires -batch\n");
+    return 1;
+  }
+  if (FuseDefinitions && !BatchMode) {
+    fprintf(stderr, "Error: -fuse requires -batch\n");
+    return 1;
+  }
+  if (!ResultsFile.empty() && !OpenResultsFile()) {
+    return 1;
+  }
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  // 声明支持的运算符以及优先级
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['*'] = 40; // 最高优先级
+
+  // 使用RuntimeDyld链接JIT生成的目标文件，以便注册GDB与perf的JIT接口：
+  // 调试器与perf可以通过DWARF行号信息把指令对应回Kaleidoscope源码
+  TheJIT = ExitOnErr(
+      orc::LLJITBuilder()
+          .setObjectLinkingLayerCreator([](orc::ExecutionSession &ES,
+                                           const Triple &) {
+            auto ObjLinkingLayer =
+                std::make_unique<orc::RTDyldObjectLinkingLayer>(ES, [] {
+                  return std::make_unique<SectionMemoryManager>();
+                });
+            if (EmitDebugInfo) {
+              ObjLinkingLayer->registerJITEventListener(
+                  *JITEventListener::createGDBRegistrationListener());
+              if (auto *PerfListener =
+                      JITEventListener::createPerfJITEventListener()) {
+                ObjLinkingLayer->registerJITEventListener(*PerfListener);
+              }
+            }
+            if (ProfileMode) {
+              ObjLinkingLayer->registerJITEventListener(TheProfiler);
+            }
+            if (MaxCodeBytes || PrintUsage) {
+              ObjLinkingLayer->registerJITEventListener(TheCodeSizeListener);
+            }
+            return ObjLinkingLayer;
+          })
+          .create());
+  // 使extern声明的函数（如sin）可以解析到当前进程中的符号
+  TheJIT->getMainJITDylib().addGenerator(
+      ExitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          TheJIT->getDataLayout().getGlobalPrefix())));
+  CurJD = &TheJIT->getMainJITDylib();
+  atexit(DestroyJIT);
+
+  if (!PreludeFile.empty()) {
+    LoadPrelude();
+  }
+  InitializeModuleAndPassManager();
+
+  // prepare for the first token.
+  fprintf(stderr, "ready> ");
+  getNextToken();
+
+  if (ProfileMode) {
+    StartProfiler();
+  }
+
+  MainLoop();
+
+  HandleBatch();
+  // 空的批次也要写出只有header的结果文件
+  bool ResultsWritten = ResultsFile.empty() || WriteResults(BatchResults);
+
+  if (ProfileMode) {
+    PrintProfile();
+  }
+  if (PrintUsage) {
+    PrintResourceUsage();
+  }
+
+  return ResultsWritten ? 0 : 1;
+}